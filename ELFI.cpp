@@ -1,5 +1,186 @@
 #include "ELFI.h"
 
+#include <util/crc16.h>
+
+/**
+ * Sine of the angles 0..90 degrees in 1 degree steps. Q14 fixed-point,
+ * i.e. 16384 is 1.0.
+ */
+static const int16_t SIN_TABLE[91] __PROGMEM = {
+  0, 286, 572, 857, 1143, 1428, 1713, 1997, 2280, 2563,
+  2845, 3126, 3406, 3686, 3964, 4240, 4516, 4790, 5063, 5334,
+  5604, 5872, 6138, 6402, 6664, 6924, 7182, 7438, 7692, 7943,
+  8192, 8438, 8682, 8923, 9162, 9397, 9630, 9860, 10087, 10311,
+  10531, 10749, 10963, 11174, 11381, 11585, 11786, 11982, 12176, 12365,
+  12551, 12733, 12911, 13085, 13255, 13421, 13583, 13741, 13894, 14044,
+  14189, 14330, 14466, 14598, 14726, 14849, 14968, 15082, 15191, 15296,
+  15396, 15491, 15582, 15668, 15749, 15826, 15897, 15964, 16026, 16083,
+  16135, 16182, 16225, 16262, 16294, 16322, 16344, 16362, 16374, 16382,
+  16384
+};
+
+/**
+ * Fixed-point sine. Interpolates linearly in SIN_TABLE.
+ * @param[in] angle in hundredths of a degree
+ * @return sine in Q14
+ */
+static int16_t
+isin(int32_t angle)
+{
+  angle %= 36000L;
+  if (angle < 0) angle += 36000L;
+  bool negate = (angle >= 18000L);
+  if (negate) angle -= 18000L;
+  if (angle > 9000L) angle = 18000L - angle;
+  
+  uint8_t i = angle / 100;
+  uint8_t f = angle % 100;
+  int16_t a = pgm_read_word(&SIN_TABLE[i]);
+  int16_t b = (i < 90) ? pgm_read_word(&SIN_TABLE[i + 1]) : a;
+  int16_t res = a + ((int32_t) (b - a) * f) / 100;
+  return (negate ? -res : res);
+}
+
+/**
+ * Fixed-point cosine.
+ * @param[in] angle in hundredths of a degree
+ * @return cosine in Q14
+ */
+static int16_t
+icos(int32_t angle)
+{
+  return (isin(angle + 9000L));
+}
+
+/**
+ * Fixed-point arc cosine. Binary search using icos().
+ * @param[in] x cosine in Q14 (-16384..16384)
+ * @return angle in hundredths of a degree (0..18000)
+ */
+static int32_t
+iacos(int16_t x)
+{
+  int32_t low = 0L;
+  int32_t high = 18000L;
+  while (low < high)
+  {
+    int32_t mid = (low + high) / 2;
+    if (icos(mid) > x) low = mid + 1; else high = mid;
+  }
+  return (low);
+}
+
+/**
+ * Compute the local time of sunrise and sunset for given day of the year at
+ * SUN_LATITUDE and SUN_LONGITUDE. Uses the solar declination and equation of
+ * time approximations in fixed-point; accurate to a few minutes. On days
+ * without sunrise or sunset both are given as solar noon (polar night) or
+ * solar midnight (midnight sun).
+ * @param[in] day of the year (0..365)
+ * @param[out] sunrise minutes after midnight
+ * @param[out] sunset minutes after midnight
+ */
+static void
+sun_times(uint16_t day, uint16_t& sunrise, uint16_t& sunset)
+{
+  // Equation of time in hundredths of a minute
+  int32_t b = (36000L * ((int32_t) day - 81)) / 365;
+  int32_t eot = (987L * isin(2 * b) - 753L * icos(b) - 150L * isin(b)) / 16384;
+  
+  // Solar declination in hundredths of a degree; corrected for the
+  // eccentricity of the earth orbit
+  int32_t g = (36000L * ((int32_t) day - 2)) / 365;
+  int32_t a = (36000L * (day + 10)) / 365 + (1914L * isin(g)) / 163840L;
+  int32_t decl = -(2344L * icos(a)) / 16384;
+  
+  // Hour angle of sunrise; the sun center 0.83 degrees below the horizon
+  int32_t num = (int32_t) isin(-83) * 16384 - (int32_t) isin(SUN_LATITUDE) * isin(decl);
+  int32_t den = ((int32_t) icos(SUN_LATITUDE) * icos(decl)) / 16384;
+  int32_t cosw = (den != 0) ? num / den : (num < 0 ? -16384 : 16384);
+  if (cosw > 16384) cosw = 16384;
+  if (cosw < -16384) cosw = -16384;
+  int32_t w = iacos(cosw);
+  
+  // Local solar noon in hundredths of a minute; four minutes per degree
+  int32_t noon = 72000L - 4L * SUN_LONGITUDE - eot + 6000L * (NTP_TIME_ZONE + NTP_SUMMER_TIME);
+  int32_t rise = (noon - 4L * w + 50) / 100;
+  int32_t set = (noon + 4L * w + 50) / 100;
+  sunrise = (rise + 1440) % 1440;
+  sunset = (set + 1440) % 1440;
+}
+
+/**
+ * Returns the event log delta for given number of seconds. Seconds up to
+ * 0x7fff are given as is; otherwise as minutes with bit 15 set.
+ * @param[in] seconds elapsed since previous entry
+ * @return delta
+ */
+static uint16_t
+log_delta(uint32_t seconds)
+{
+  if (seconds < 0x8000L) return (seconds);
+  uint32_t minutes = seconds / 60;
+  return (0x8000 | (minutes < 0x8000L ? minutes : 0x7fff));
+}
+
+/**
+ * Returns the number of seconds of given event log delta.
+ * @param[in] delta of log entry
+ * @return seconds
+ */
+static uint32_t
+log_seconds(uint16_t delta)
+{
+  return ((delta & 0x8000) ? (delta & 0x7fffL) * 60 : delta);
+}
+
+/**
+ * Returns the fade level of given switch mode; 0 for OFF, 1..15 for dim
+ * level -1..-15 and 16 for ON.
+ * @param[in] mode switch mode
+ * @return fade level
+ */
+static uint8_t
+fade_level(int8_t mode)
+{
+  if (mode == 0) return (0);
+  if (mode == 1) return (16);
+  return (-mode);
+}
+
+/**
+ * Returns the switch mode of given fade level. Inverse of fade_level().
+ * @param[in] level fade level
+ * @return switch mode
+ */
+static int8_t
+fade_mode(uint8_t level)
+{
+  if (level == 0) return (0);
+  if (level == 16) return (1);
+  return (-level);
+}
+
+/**
+ * Days before the first of each month in a non-leap year.
+ */
+static const uint16_t MONTH_DAYS[12] __PROGMEM = {
+  0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
+};
+
+/**
+ * Returns the day of the year (0..365) of given time.
+ * @param[in] time
+ * @return day of the year
+ */
+static uint16_t
+day_of_year(const time_t& time)
+{
+  uint16_t day = pgm_read_word(&MONTH_DAYS[time.month - 1]) + time.date - 1;
+  if ((time.month > 2) && ((time.year % 4) == 0)) day++;
+  return (day);
+}
+
 void
 ELFI::initialize() {  
   // Initialize NEXA Switches
@@ -11,9 +192,44 @@ ELFI::initialize() {
       m_switch_name[id] = str;
       m_switch_dimable[id] = false;
       m_switch_activated[id] = false;
+      m_switch_mode[id] = UNKNOWN_MODE;
     }
   }
   
+  m_time_valid = false;
+  m_time_estimated = false;
+  m_journal_since = 0;
+  m_journal_clock = 0L;
+  m_sunrise = 0;
+  m_sunset = 0;
+  m_sun_next = 0L;
+  
+  // Initialize fades
+  for (int i = 0; i < FADES; i++) m_fades[i].switches = 0;
+  for (int id = 0; id < NEXA_SWITCHES; id++) m_fade_level[id] = FADE_LEVEL_NONE;
+  m_fade_next = 0;
+  m_fade_slot = 0L;
+  m_lateness = 0;
+  m_lateness_max = 0;
+  m_http_second = 0L;
+  m_http_count = 0;
+  
+  // Initialize event log
+  m_log_head = 0;
+  m_log_count = 0;
+  m_log_source = LOG_SKETCH;
+  m_log_loaded = 0;
+  m_log_ntp = -1;
+  m_log_clock = 0L;
+  m_log_loaded_clock = 0L;
+  
+  // Initialize boot stages
+  m_boot_stage = BOOT_RESTORE;
+  m_boot_start = 0L;
+  m_boot_attempt = 0L;
+  m_boot_retry = 0L;
+  for (int stage = 0; stage < BOOT_STAGES; stage++) m_boot_time[stage] = 0L;
+  
   // Initialize NEXA Activities
   {
     static const String str = "NEXA Activity";
@@ -29,31 +245,28 @@ ELFI::initialize() {
 bool
 ELFI::begin(NEXA::Transmitter * transmitter, W5100 * ethernet, bool webserverflag)
 {  
+  if (transmitter == NULL) return (false);
+  
   m_transmitter = transmitter;
   m_ethernet = ethernet;
   m_webserverflag = webserverflag;
   
-  if(m_ethernet != NULL)
-  {
-    // Initiate the ethernet controller using DHCP
-    bool res;
-    res = m_ethernet->begin_P(PSTR("ElFi"));
-    if (!res) return (false);
-    
-    // Start the webserver if it shoudl be used.
-    if(m_webserverflag)
-    {
-      res = m_webserver.begin(m_ethernet->socket(Socket::TCP, WEBSERVER_PORT));
-      if (!res) return (false);
-    }
-    
-    // Set the clock using a NTP
-    time_t::epoch_year( NTP_EPOCH_YEAR );
-    time_t::epoch_weekday = NTP_EPOCH_WEEKDAY;
-    time_t::pivot_year = 37; // 1937..2036 range
-    update_RTC();
-  }
+  // Time is given as NTP time; also for the time restored from the journal
+  time_t::epoch_year( NTP_EPOCH_YEAR );
+  time_t::epoch_weekday = NTP_EPOCH_WEEKDAY;
+  time_t::pivot_year = 37; // 1937..2036 range
+  
+  // Restore the event log, NEXA switch states, activity configuration
+  // and time
+  m_boot_start = RTC::millis();
+  load_log();
+  log(LOG_BOOT, LOG_NO_DEVICE, 0);
+  restore();
+  m_boot_time[BOOT_RESTORE] = RTC::millis() - m_boot_start;
   
+  // Start the activities from the last known time
+  m_boot_start = RTC::millis();
+  if (m_time_valid) update_sun();
   if(NEXA_ACTIVITIES > 0)
   {
     m_scheduler.begin();
@@ -66,25 +279,157 @@ ELFI::begin(NEXA::Transmitter * transmitter, W5100 * ethernet, bool webserverfla
       }
     }
   }
+  m_boot_time[BOOT_SCHEDULER] = RTC::millis() - m_boot_start;
+  
+  // Bring up the network in the background
+  m_boot_start = RTC::millis();
+  m_boot_stage = (m_ethernet != NULL) ? BOOT_DHCP : BOOT_STAGES;
   
   return (true);
 }
 
 int
 ELFI::run()
+{
+  uint32_t start = RTC::millis();
+  
+  // Scheduled RF activities and watchdog events first
+  dispatch();
+  
+  // Move the sun triggered activities once a day
+  if (m_time_valid && (RTC::time() >= m_sun_next))
+  {
+    update_sun();
+  }
+  
+  // Service incoming requests unless an activity is due. Deferred requests
+  // are kept waiting by the ethernet controller
+  int res = 0;
+  if (m_webserverflag && (m_boot_stage > BOOT_WEBSERVER) && !is_due(SCHEDULER_HTTP_GUARD))
+  {
+    res = m_webserver.run(SCHEDULER_HTTP_WAIT);
+    dispatch();
+  }
+  
+  // Background work within what is left of the time budget
+  if ((RTC::millis() - start >= SCHEDULER_BUDGET) || is_due(SCHEDULER_BOOT_GUARD))
+  {
+    return res;
+  }
+  
+  // Continue the network boot
+  if (m_boot_stage < BOOT_STAGES)
+  {
+    boot();
+  }
+  
+  // Record the current time now and then
+  if (m_time_valid && (RTC::time() - m_journal_clock >= JOURNAL_CLOCK_PERIOD))
+  {
+    record(Journal::CLOCK_RECORD, 0, 0);
+  }
+  return res;
+}
+
+void
+ELFI::dispatch()
 {
   // The standard event dispatcher
   Event event;
   while (Event::queue.dequeue( &event ))
     event.dispatch();
+  
+  // Fades are sent in the same priority as the activities
+  run_fades();
+}
+
+bool
+ELFI::is_due(uint16_t guard)
+{
+  if (!m_time_valid) return (false);
+  
+  // Seconds after midnight; the clock is in local time
+  uint32_t now = RTC::time() % SECONDS_PER_DAY;
+  for (int id = 0; id < NEXA_ACTIVITIES; id++)
+  {
+    NEXAActivity & activity = m_activities[id];
+    if (!activity.m_activated || !activity.m_enabled) continue;
     
-  // Service incoming requests
-  int res = 0;
-  if(m_webserverflag)
+    // Due within guard or just passed and possibly not yet dispatched
+    uint32_t at = activity.m_hours * 3600L + activity.m_minutes * 60L;
+    uint32_t delta = (at + SECONDS_PER_DAY - now) % SECONDS_PER_DAY;
+    if ((delta > guard) && (delta < SECONDS_PER_DAY - 1)) continue;
+    
+    // On a day the activity is dispatched; the due time may be tomorrow
+    clock_t clock = RTC::time();
+    time_t time = (delta <= guard) ? clock + delta : clock - 1;
+    if (activity.m_days[time.day - 1]) return (true);
+  }
+  return (false);
+}
+
+bool
+ELFI::admit()
+{
+  // Count the requests in the current second
+  uint32_t now = RTC::millis() / 1000;
+  if (now != m_http_second)
   {
-    res = m_webserver.run(5L);
+    m_http_second = now;
+    m_http_count = 0;
   }
-  return res;
+  if (m_http_count >= SCHEDULER_HTTP_LOAD) return (false);
+  m_http_count++;
+  return (true);
+}
+
+void
+ELFI::boot()
+{
+  // Wait for retry of a failed stage
+  if (RTC::millis() - m_boot_attempt < m_boot_retry) return;
+  
+  bool res = false;
+  switch (m_boot_stage)
+  {
+    case BOOT_DHCP :
+      // Initiate the ethernet controller using DHCP
+      res = m_ethernet->begin_P(PSTR("ElFi"));
+      break;
+    case BOOT_WEBSERVER :
+      // Start the webserver if it should be used
+      res = !m_webserverflag ||
+        m_webserver.begin(m_ethernet->socket(Socket::TCP, WEBSERVER_PORT));
+      break;
+    case BOOT_NTP :
+      // Set the clock using a NTP and catch up with the activities
+      res = update_RTC();
+      if (res)
+      {
+        for (int id = 0; id < NEXA_ACTIVITIES; id++)
+        {
+          if (m_activities[id].m_activated) m_activities[id].enable();
+        }
+        reconcile();
+      }
+      break;
+  }
+  
+  // Retry a failed stage with a growing delay. The stage time includes
+  // the failed attempts
+  if (!res)
+  {
+    m_boot_retry = (m_boot_retry == 0L) ? BOOT_RETRY_MIN : m_boot_retry * 2;
+    if (m_boot_retry > BOOT_RETRY_MAX) m_boot_retry = BOOT_RETRY_MAX;
+    m_boot_attempt = RTC::millis();
+    return;
+  }
+  
+  uint32_t now = RTC::millis();
+  m_boot_time[m_boot_stage] = now - m_boot_start;
+  m_boot_start = now;
+  m_boot_retry = 0L;
+  m_boot_stage++;
 }
 
 bool
@@ -123,6 +468,44 @@ ELFI::activate_NEXA_Activity(uint8_t id, String str, const bool (&d)[7], uint8_t
   return (false);
 }
 
+bool
+ELFI::activate_NEXA_Activity(uint8_t id, String str, const bool (&d)[7], Trigger trigger, int16_t offset, uint8_t mode, uint8_t sid)
+{
+  // The time of dispatch is set by update_sun()
+  if (!activate_NEXA_Activity(id, str, d, 0, 0, mode, sid)) return (false);
+  m_activities[id].m_trigger = trigger;
+  m_activities[id].m_offset = offset;
+  m_sun_next = 0L;
+  return (true);
+}
+
+bool
+ELFI::fade_NEXA_Activity(uint8_t id, int8_t from, uint16_t seconds)
+{
+  if ((id < NEXA_ACTIVITIES) && m_activities[id].m_activated)
+  {
+    m_activities[id].m_fade_from = from;
+    m_activities[id].m_fade = seconds;
+    return (true);
+  }
+  return (false);
+}
+
+bool
+ELFI::enable_NEXA_Activity(uint8_t id, bool enable)
+{
+  if ((id < NEXA_ACTIVITIES) && m_activities[id].m_activated)
+  {
+    if (m_activities[id].m_enabled != enable)
+    {
+      m_activities[id].m_enabled = enable;
+      record(Journal::ACTIVITY_RECORD, id, enable);
+    }
+    return (true);
+  }
+  return (false);
+}
+
 void
 ELFI::switch_to(uint8_t id, int8_t mode)
 {
@@ -144,12 +527,16 @@ void
 ELFI::switch_on(uint8_t id)
 {
   m_transmitter->send(id, 1);
+  log(m_log_source, id, 1);
+  set_mode(id, 1);
 }
 
 void
 ELFI::switch_off(uint8_t id)
 {
   m_transmitter->send(id, 0);
+  log(m_log_source, id, 0);
+  set_mode(id, 0);
 }
 
 int
@@ -158,6 +545,8 @@ ELFI::switch_dim(uint8_t id, int8_t dim)
   if(m_switch_dimable[id]) {
     if((dim > -16) && (dim < 0)) {
       m_transmitter->send(id, dim);
+      log(m_log_source, id, dim);
+      set_mode(id, dim);
 
       return (0);
     }
@@ -173,6 +562,8 @@ ELFI::switch_on()
   m_transmitter->broadcast(1, 1);
   m_transmitter->broadcast(2, 1);
   m_transmitter->broadcast(3, 1);
+  log(m_log_source, NEXA_SWITCHES, 1);
+  set_mode(NEXA_SWITCHES, 1);
 }
 
 void
@@ -182,16 +573,449 @@ ELFI::switch_off()
   m_transmitter->broadcast(1, 0);
   m_transmitter->broadcast(2, 0);
   m_transmitter->broadcast(3, 0);
+  log(m_log_source, NEXA_SWITCHES, 0);
+  set_mode(NEXA_SWITCHES, 0);
 }
 
-void
+bool
 ELFI::update_RTC()
 {
-  // Update the RTC
-  RTC::time(get_NTP_time());
+  // Keep the current time if the NTP could not be reached. Log when the
+  // outcome changes; the boot retries a failed attempt
+  clock_t clock = get_NTP_time();
+  int8_t res = (clock != 0L);
+  if (res != m_log_ntp)
+  {
+    log(LOG_UDP, LOG_NO_DEVICE, res);
+    m_log_ntp = res;
+  }
+  if (clock == 0L) return (false);
+  
+  // Update the RTC and match time in Alarm with RTC
+  set_clock(clock);
+  m_time_estimated = false;
+  record(Journal::CLOCK_RECORD, 0, 0);
+  return (true);
+}
+
+void
+ELFI::set_clock(clock_t clock)
+{
+  // Move the time of the event log entries along with the clock
+  m_log_clock += clock - RTC::time();
+  
+  RTC::time(clock);
+  Alarm::set_time(clock);
+  m_time_valid = true;
+  m_sun_next = 0L;
+}
+
+void
+ELFI::log(uint8_t source, uint8_t device, int8_t mode)
+{
+  // Seconds since previous entry; minutes if too long. The first entry after
+  // start has no previous entry in the same time line
+  clock_t now = RTC::time();
+  uint32_t elapsed = ((m_log_count > m_log_loaded) && (now > m_log_clock)) ? now - m_log_clock : 0L;
+  m_log_clock = now;
+  
+  log_entry_t & entry = m_log[m_log_head];
+  entry.delta = log_delta(elapsed);
+  entry.source_device = (source << 5) | (device & LOG_NO_DEVICE);
+  entry.mode = mode;
+  m_log_head = (m_log_head + 1) % LOG_ENTRIES;
+  if (m_log_count < LOG_ENTRIES) m_log_count++;
+  else if (m_log_loaded > 0) m_log_loaded--;
+  
+#if LOG_EEPROM_ENTRIES > 0
+  m_log_spill.append(source, device, mode, m_time_valid ? now : 0L);
+#endif
+}
+
+void
+ELFI::load_log()
+{
+#if LOG_EEPROM_ENTRIES > 0
+  uint8_t count = m_log_spill.begin();
+  for (uint8_t nr = 0; nr < count; nr++)
+  {
+    Journal::record_t rec;
+    if (!m_log_spill.read(nr, rec)) continue;
+    
+    // Seconds since previous entry; zero if unknown
+    uint32_t elapsed = 0L;
+    if ((rec.clock != 0L) && (m_log_loaded_clock != 0L) && (rec.clock > m_log_loaded_clock))
+    {
+      elapsed = rec.clock - m_log_loaded_clock;
+    }
+    if (rec.clock != 0L) m_log_loaded_clock = rec.clock;
+    
+    log_entry_t & entry = m_log[m_log_head];
+    entry.delta = log_delta(elapsed);
+    entry.source_device = (rec.type << 5) | (rec.id & LOG_NO_DEVICE);
+    entry.mode = rec.value;
+    m_log_head = (m_log_head + 1) % LOG_ENTRIES;
+    if (m_log_count < LOG_ENTRIES) m_log_count++;
+  }
+  m_log_loaded = m_log_count;
+#endif
+}
+
+void
+ELFI::restore()
+{
+  // Replay the journal from the oldest to the newest record. The latest
+  // record for each switch and activity wins.
+  uint8_t count = m_journal.begin();
+  uint8_t snapshot = count;
+  uint8_t size = 0;
+  for (uint8_t nr = 0; nr < count; nr++)
+  {
+    Journal::record_t rec;
+    if (!m_journal.read(nr, rec)) continue;
+    if (rec.clock > m_journal_clock) m_journal_clock = rec.clock;
+    switch (rec.type & ~Journal::ESTIMATED)
+    {
+      case Journal::SNAPSHOT_RECORD :
+        snapshot = nr;
+        size = rec.value;
+        break;
+      case Journal::SWITCH_RECORD :
+        if (rec.id < NEXA_SWITCHES)
+        {
+          m_switch_mode[rec.id] = rec.value;
+        }
+        break;
+      case Journal::ACTIVITY_RECORD :
+        if (rec.id < NEXA_ACTIVITIES)
+        {
+          m_activities[rec.id].m_enabled = (rec.value != 0);
+        }
+        break;
+    }
+  }
+  m_journal_since = count - (snapshot < count ? snapshot : 0);
+  
+  // Start from the last known time until the NTP has been reached. Changes
+  // are recorded as estimated until then
+  if (!m_time_valid && (m_journal_clock != 0L))
+  {
+    set_clock(m_journal_clock);
+    m_time_estimated = true;
+  }
+  
+  // Write a new snapshot if the latest was torn by a power cut
+  if ((snapshot < count) && (count - snapshot - 1 < size)) compact();
+  
+  // Switch to the restored modes
+  for (int id = 0; id < NEXA_SWITCHES; id++)
+  {
+    if (m_switch_activated[id] && (m_switch_mode[id] != UNKNOWN_MODE))
+    {
+      m_transmitter->send(id, m_switch_mode[id]);
+      log(LOG_BOOT, id, m_switch_mode[id]);
+    }
+  }
+  
+  reconcile();
+}
+
+void
+ELFI::reconcile()
+{
+  // The estimated time may lag the real time by the length of the power cut
+  if (!m_time_valid || m_time_estimated) return;
+  
+  // Find the time of the latest change of each switch. A change recorded
+  // with an estimated or unknown time, i.e. before the clock was set, cannot
+  // be ordered against the activities; the switch keeps the recorded mode
+  clock_t changed[NEXA_SWITCHES];
+  bool estimated[NEXA_SWITCHES];
+  for (int id = 0; id < NEXA_SWITCHES; id++)
+  {
+    changed[id] = 0L;
+    estimated[id] = false;
+  }
+  
+  uint8_t count = m_journal.begin();
+  for (uint8_t nr = 0; nr < count; nr++)
+  {
+    Journal::record_t rec;
+    if (!m_journal.read(nr, rec)) continue;
+    if (((rec.type & ~Journal::ESTIMATED) == Journal::SWITCH_RECORD) && (rec.id < NEXA_SWITCHES))
+    {
+      changed[rec.id] = rec.clock;
+      estimated[rec.id] = ((rec.type & Journal::ESTIMATED) != 0) || (rec.clock == 0L);
+    }
+  }
+  
+  // Find when the activities last should have been dispatched
+  clock_t dispatched[NEXA_ACTIVITIES];
+  for (int id = 0; id < NEXA_ACTIVITIES; id++)
+  {
+    NEXAActivity & activity = m_activities[id];
+    if (activity.m_activated && activity.m_enabled)
+    {
+      dispatched[id] = activity.last_dispatch(RTC::time());
+    }
+    else
+    {
+      dispatched[id] = 0L;
+    }
+  }
+  
+  // Reconcile each switch with the activities dispatched after the last
+  // change and switch if the mode differs
+  for (int id = 0; id < NEXA_SWITCHES; id++)
+  {
+    if (!m_switch_activated[id] || estimated[id]) continue;
+    
+    int8_t mode = m_switch_mode[id];
+    clock_t at = changed[id];
+    for (int aid = 0; aid < NEXA_ACTIVITIES; aid++)
+    {
+      uint8_t sid = m_activities[aid].m_switch;
+      if ((dispatched[aid] > at) && (sid == id || sid == NEXA_SWITCHES))
+      {
+        mode = m_activities[aid].m_mode;
+        at = dispatched[aid];
+      }
+    }
+    
+    if ((mode == UNKNOWN_MODE) || (mode == m_switch_mode[id])) continue;
+    m_transmitter->send(id, mode);
+    log(LOG_BOOT, id, mode);
+    set_mode(id, mode);
+  }
+}
 
-  // Match time in Alarm with RTC
-  Alarm::set_time(RTC::time());
+void
+ELFI::set_mode(uint8_t id, int8_t mode)
+{
+  if (id == NEXA_SWITCHES)
+  {
+    for (uint8_t sid = 0; sid < NEXA_SWITCHES; sid++)
+    {
+      if (m_switch_activated[sid]) set_mode(sid, mode);
+    }
+  }
+  else if (id < NEXA_SWITCHES)
+  {
+    // A command to the switch stops the fade
+    stop_fade(id);
+    if (m_switch_mode[id] != mode)
+    {
+      m_switch_mode[id] = mode;
+      record(Journal::SWITCH_RECORD, id, mode);
+    }
+  }
+}
+
+void
+ELFI::record(uint8_t type, uint8_t id, int8_t value)
+{
+  clock_t clock = m_time_valid ? RTC::time() : 0L;
+  m_journal.append(m_time_estimated ? type | Journal::ESTIMATED : type, id, value, clock);
+  m_journal_since++;
+  if (type == Journal::CLOCK_RECORD) m_journal_clock = clock;
+  
+  // Compact while the latest snapshot may still be kept intact
+  if (m_journal_since + SNAPSHOT_MAX >= JOURNAL_RECORDS) compact();
+}
+
+void
+ELFI::compact()
+{
+  clock_t clock = m_time_valid ? RTC::time() : 0L;
+  uint8_t flag = m_time_estimated ? Journal::ESTIMATED : 0;
+  
+  // Count the records of the snapshot
+  uint8_t size = 1;
+  for (int id = 0; id < NEXA_SWITCHES; id++)
+  {
+    if (m_switch_mode[id] != UNKNOWN_MODE) size++;
+  }
+  for (int id = 0; id < NEXA_ACTIVITIES; id++)
+  {
+    if (m_activities[id].m_activated) size++;
+  }
+  
+  // Append the snapshot
+  m_journal.append(Journal::SNAPSHOT_RECORD | flag, 0, size, clock);
+  m_journal.append(Journal::CLOCK_RECORD | flag, 0, 0, clock);
+  for (int id = 0; id < NEXA_SWITCHES; id++)
+  {
+    if (m_switch_mode[id] != UNKNOWN_MODE)
+    {
+      m_journal.append(Journal::SWITCH_RECORD | flag, id, m_switch_mode[id], clock);
+    }
+  }
+  for (int id = 0; id < NEXA_ACTIVITIES; id++)
+  {
+    if (m_activities[id].m_activated)
+    {
+      m_journal.append(Journal::ACTIVITY_RECORD | flag, id, m_activities[id].m_enabled, clock);
+    }
+  }
+  m_journal_since = size + 1;
+  if (clock != 0L) m_journal_clock = clock;
+}
+
+bool
+ELFI::fade(uint8_t id, int8_t from, int8_t to, uint16_t seconds)
+{
+  if ((from > 1) || (from < -15) || (to > 1) || (to < -15)) return (false);
+  
+  // Dimable switches to fade
+  uint16_t switches = 0;
+  for (uint8_t sid = 0; sid < NEXA_SWITCHES; sid++)
+  {
+    if (((sid == id) || (id == NEXA_SWITCHES)) && m_switch_activated[sid] && m_switch_dimable[sid])
+    {
+      switches |= (1 << sid);
+    }
+  }
+  if (switches == 0) return (false);
+  
+  if (!start_fade(switches, from, to, seconds)) return (false);
+  log(m_log_source, id, to);
+  return (true);
+}
+
+bool
+ELFI::start_fade(uint16_t switches, int8_t from, int8_t to, uint16_t seconds)
+{
+  // Keep a running fade of the switches with the same levels and duration
+  uint32_t now = RTC::millis();
+  uint32_t duration = seconds * 1000L;
+  for (int i = 0; i < FADES; i++)
+  {
+    fade_t & f = m_fades[i];
+    if (((f.switches & switches) == switches) &&
+        (f.from == fade_level(from)) && (f.to == fade_level(to)) &&
+        (f.duration == duration) && (now - f.start < f.duration))
+    {
+      return (true);
+    }
+  }
+  
+  // Replace ongoing fades of the switches
+  for (uint8_t sid = 0; sid < NEXA_SWITCHES; sid++)
+  {
+    if (switches & (1 << sid)) stop_fade(sid);
+  }
+  
+  // Merge with a fade started in the same slot with the same levels and
+  // duration. Otherwise use a free fade
+  fade_t * free = NULL;
+  for (int i = 0; i < FADES; i++)
+  {
+    fade_t & f = m_fades[i];
+    if (f.switches == 0)
+    {
+      if (free == NULL) free = &f;
+    }
+    else if ((f.from == fade_level(from)) && (f.to == fade_level(to)) &&
+             (f.duration == duration) && (now - f.start < FADE_SLOT))
+    {
+      f.switches |= switches;
+      return (true);
+    }
+  }
+  if (free == NULL) return (false);
+  
+  free->switches = switches;
+  free->from = fade_level(from);
+  free->to = fade_level(to);
+  free->start = now;
+  free->duration = duration;
+  return (true);
+}
+
+void
+ELFI::run_fades()
+{
+  // One frame per fade slot
+  uint32_t now = RTC::millis();
+  if (now - m_fade_slot < FADE_SLOT) return;
+  
+  // Send the current level to the next switch, taking turns, that is not
+  // at the level. Steps missed since the previous frame are merged
+  for (uint8_t n = 0; n < NEXA_SWITCHES; n++)
+  {
+    uint8_t sid = m_fade_next;
+    m_fade_next = (m_fade_next + 1) % NEXA_SWITCHES;
+    for (int i = 0; i < FADES; i++)
+    {
+      fade_t & f = m_fades[i];
+      if ((f.switches & (1 << sid)) == 0) continue;
+      
+      uint32_t elapsed = now - f.start;
+      uint8_t level = f.to;
+      if (elapsed < f.duration)
+      {
+        level = f.from + ((int32_t) (f.to - f.from) * (int32_t) elapsed) / (int32_t) f.duration;
+      }
+      if (level == m_fade_level[sid]) break;
+      
+      // The next slot starts when the blocking send is done
+      m_transmitter->send(sid, fade_mode(level));
+      m_fade_level[sid] = level;
+      m_fade_slot = RTC::millis();
+      return;
+    }
+  }
+  
+  // All switches are at their current level. Free the fades that are
+  // completed and record the switch modes
+  for (int i = 0; i < FADES; i++)
+  {
+    fade_t & f = m_fades[i];
+    if ((f.switches == 0) || (now - f.start < f.duration)) continue;
+    
+    uint16_t switches = f.switches;
+    int8_t mode = fade_mode(f.to);
+    f.switches = 0;
+    for (uint8_t sid = 0; sid < NEXA_SWITCHES; sid++)
+    {
+      if (switches & (1 << sid)) set_mode(sid, mode);
+    }
+  }
+}
+
+void
+ELFI::stop_fade(uint8_t id)
+{
+  for (int i = 0; i < FADES; i++)
+  {
+    m_fades[i].switches &= ~(1 << id);
+  }
+  m_fade_level[id] = FADE_LEVEL_NONE;
+}
+
+void
+ELFI::update_sun()
+{
+  time_t now = RTC::time();
+  sun_times(day_of_year(now), m_sunrise, m_sunset);
+  
+  for (int id = 0; id < NEXA_ACTIVITIES; id++)
+  {
+    NEXAActivity & activity = m_activities[id];
+    if (activity.m_trigger == 0) continue;
+    
+    int16_t minutes = (activity.m_trigger == SUNRISE ? m_sunrise : m_sunset) + activity.m_offset;
+    minutes = (minutes % 1440 + 1440) % 1440;
+    activity.m_hours = minutes / 60;
+    activity.m_minutes = minutes % 60;
+    if (activity.m_activated && (m_boot_stage > BOOT_SCHEDULER)) activity.enable();
+  }
+  
+  // Next update at midnight
+  now.hours = 0;
+  now.minutes = 0;
+  now.seconds = 0;
+  m_sun_next = (clock_t) now + SECONDS_PER_DAY;
 }
 
 clock_t
@@ -208,11 +1032,15 @@ ELFI::get_NTP_time()
   // Connect to the NTP server using given socket
   NTP ntp(m_ethernet->socket(Socket::UDP), server, NTP_TIME_ZONE + NTP_SUMMER_TIME);
 
-  // Get current time. Allow a number of retries
+  // Get current time. Allow a number of retries but give way to a due
+  // activity; the boot stage is retried later
   const uint8_t RETRY_MAX = 20;
-  clock_t clock;
+  clock_t clock = 0L;
   for (uint8_t retry = 0; retry < RETRY_MAX; retry++)
+  {
     if ((clock = ntp.time()) != 0L) break;
+    if (is_due(SCHEDULER_HTTP_GUARD)) break;
+  }
   if(clock == 0L) return 0L;
 
   return clock;
@@ -237,14 +1065,76 @@ ELFI::NEXAActivity::enable()
   Activity::enable();
 }
 
+clock_t
+ELFI::NEXAActivity::last_dispatch(clock_t now)
+{
+  // Time of the activity today
+  time_t start = now;
+  start.hours = m_hours;
+  start.minutes = m_minutes;
+  start.seconds = 0;
+  clock_t clock = start;
+  if (clock > now) clock -= SECONDS_PER_DAY;
+  
+  // Step back to the latest day the activity is dispatched on
+  for (uint8_t i = 0; i < 7; i++, clock -= SECONDS_PER_DAY)
+  {
+    time_t time = clock;
+    if (m_days[time.day - 1]) return (clock);
+  }
+  return (0L);
+}
+
 void
 ELFI::NEXAActivity::run()
 {  
-  if (m_activated)
+  if (m_activated && m_enabled)
   {
-    time_t time = RTC::time();
-    uint8_t d = time.day;
-    if (m_days[d])
+    // The activity runs every second of its minute; dispatch on the first
+    clock_t now = RTC::time();
+    time_t time = now;
+    if (!m_days[time.day - 1]) return;
+    clock_t at = last_dispatch(now);
+    if (at == m_dispatched) return;
+    m_dispatched = at;
+    
+    // Measure the lateness of the dispatch
+    uint32_t late = now - at;
+    if (late > 0xffffL) late = 0xffffL;
+    m_parent->m_lateness = late;
+    if (late > m_parent->m_lateness_max) m_parent->m_lateness_max = late;
+    
+    // Fade the dimable switches if requested. The other switches are
+    // switched in the following fade slots; without a free fade all
+    // switches are switched at once
+    bool faded = false;
+    if (m_fade != 0)
+    {
+      m_parent->m_log_source = LOG_ACTIVITY;
+      faded = m_parent->fade(m_switch, m_fade_from, m_mode, m_fade);
+      m_parent->m_log_source = LOG_SKETCH;
+      if (faded && (m_switch == NEXA_SWITCHES))
+      {
+        uint16_t switches = 0;
+        for (uint8_t sid = 0; sid < NEXA_SWITCHES; sid++)
+        {
+          if (m_parent->m_switch_activated[sid] && !m_parent->m_switch_dimable[sid])
+          {
+            switches |= (1 << sid);
+          }
+        }
+        if ((switches != 0) && !m_parent->start_fade(switches, m_mode, m_mode, 0))
+        {
+          for (uint8_t sid = 0; sid < NEXA_SWITCHES; sid++)
+          {
+            if (m_parent->m_switch_dimable[sid]) m_parent->stop_fade(sid);
+          }
+          faded = false;
+        }
+      }
+    }
+    
+    if (!faded)
     {
       if (m_switch != NEXA_SWITCHES)
       {
@@ -257,8 +1147,273 @@ ELFI::NEXAActivity::run()
         m_parent->m_transmitter->broadcast(2, m_mode);
         m_parent->m_transmitter->broadcast(3, m_mode);
       }
+      m_parent->log(LOG_ACTIVITY, m_switch, m_mode);
+      m_parent->set_mode(m_switch, m_mode);
+    }
+  }
+}
+
+uint8_t
+ELFI::Journal::begin()
+{
+  m_head = 0;
+  m_count = 0;
+  m_seq = 0;
+  
+  // The newest record is the one not followed by the next sequence number
+  bool found = false;
+  for (uint8_t ix = 0; ix < m_records; ix++)
+  {
+    uint8_t seq, following;
+    m_eeprom.read(&seq, &address(ix)->seq, sizeof(seq));
+    if (seq == 0xff) continue;
+    m_count++;
+    if (found) continue;
+    uint8_t nx = (ix + 1) % m_records;
+    m_eeprom.read(&following, &address(nx)->seq, sizeof(following));
+    if (following != next(seq))
+    {
+      m_head = nx;
+      m_seq = next(seq);
+      found = true;
+    }
+  }
+  return (m_count);
+}
+
+bool
+ELFI::Journal::read(uint8_t nr, record_t& rec)
+{
+  if (nr >= m_count) return (false);
+  uint8_t ix = (m_head + m_records - m_count + nr) % m_records;
+  m_eeprom.read(&rec, address(ix), sizeof(rec));
+  return ((rec.seq != 0xff) && (rec.check == checksum(rec)));
+}
+
+void
+ELFI::Journal::append(uint8_t type, uint8_t id, int8_t value, clock_t clock)
+{
+  record_t rec;
+  rec.seq = m_seq;
+  rec.type = type;
+  rec.id = id;
+  rec.value = value;
+  rec.clock = clock;
+  rec.check = checksum(rec);
+  m_eeprom.write(address(m_head), &rec, sizeof(rec));
+  
+  m_head = (m_head + 1) % m_records;
+  m_seq = next(m_seq);
+  if (m_count < m_records) m_count++;
+}
+
+uint8_t
+ELFI::Journal::checksum(const record_t& rec)
+{
+  const uint8_t* bp = (const uint8_t*) &rec;
+  uint8_t crc = 0;
+  for (uint8_t i = 0; i < sizeof(rec) - sizeof(rec.check); i++)
+    crc = _crc_ibutton_update(crc, bp[i]);
+  return (crc);
+}
+
+bool
+ELFI::register_handler(str_P method, str_P path, Handler handler)
+{
+  if ((path == NULL) || (handler == NULL)) return (false);
+  if (m_webserver.m_routes_count == WEBSERVER_HANDLERS) return (false);
+  
+  WebServer::route_t & route = m_webserver.m_routes[m_webserver.m_routes_count++];
+  route.method = method;
+  route.path = path;
+  route.handler = handler;
+  return (true);
+}
+
+void
+ELFI::reply(IOStream& page, uint16_t status)
+{
+  static const char no_content[] __PROGMEM =
+    "HTTP/1.1 204 No Content" CRLF;
+  static const char not_found[] __PROGMEM =
+    "HTTP/1.1 404 Not Found" CRLF;
+  static const char unavailable[] __PROGMEM =
+    "HTTP/1.1 503 Service Unavailable" CRLF
+    "Retry-After: 1" CRLF;
+  static const char headers[] __PROGMEM =
+    "Content-Length: 0" CRLF
+    "Connection: close" CRLF CRLF;
+  
+  switch (status)
+  {
+    case 204 :
+      page << (str_P) no_content;
+      break;
+    case 503 :
+      page << (str_P) unavailable;
+      break;
+    default:
+      page << (str_P) not_found;
+      break;
+  }
+  page << (str_P) headers;
+}
+
+/**
+ * Built-in routes. Matched in order before the routes registered by the
+ * sketch.
+ */
+static const char GET[] __PROGMEM = "GET";
+static const char ROOT_PATH[] __PROGMEM = "/";
+static const char ICON_PATH[] __PROGMEM = "/favicon.ico";
+static const char LOG_PATH[] __PROGMEM = "/log";
+static const char CSV_QUERY[] __PROGMEM = "csv";
+
+const ELFI::WebServer::route_t ELFI::WebServer::s_routes[] __PROGMEM = {
+  { (str_P) GET, (str_P) ROOT_PATH, &ELFI::WebServer::on_page },
+  { NULL, (str_P) ICON_PATH, &ELFI::WebServer::on_icon },
+  { (str_P) GET, (str_P) LOG_PATH, &ELFI::WebServer::on_log },
+  { NULL, NULL, NULL }
+};
+
+void
+ELFI::WebServer::on_request(IOStream& page, char* method, char* path, char* query)
+{
+  // Shed requests above the load limit
+  if (!m_parent->admit())
+  {
+    reply(page, 503);
+    return;
+  }
+  
+  // Search the built-in routes
+  route_t route;
+  for (const route_t* rp = s_routes; ; rp++)
+  {
+    memcpy_P(&route, rp, sizeof(route));
+    if (route.path == NULL) break;
+    if (match(route, method, path))
+    {
+      route.handler(m_parent, page, method, path, query);
+      return;
     }
   }
+  
+  // Search the routes registered by the sketch
+  for (uint8_t i = 0; i < m_routes_count; i++)
+  {
+    if (match(m_routes[i], method, path))
+    {
+      m_routes[i].handler(m_parent, page, method, path, query);
+      return;
+    }
+  }
+  
+  reply(page, 404);
+}
+
+bool
+ELFI::WebServer::match(const route_t& route, const char* method, const char* path)
+{
+  if ((route.method != NULL) && (strcmp_P(method, (const char*) route.method) != 0)) return (false);
+  
+  size_t len = strlen_P((const char*) route.path);
+  if (strncmp_P(path, (const char*) route.path, len) != 0) return (false);
+  return ((path[len] == 0) || (path[len] == '/'));
+}
+
+void
+ELFI::WebServer::on_page(ELFI* elfi, IOStream& page, char* method, char* path, char* query)
+{
+  UNUSED(method);
+  UNUSED(path);
+  if (query != NULL)
+  {
+    elfi->m_webserver.handle_query(query);
+    reply(page, 204);
+  }
+  else
+  {
+    elfi->m_webserver.render(page);
+  }
+}
+
+/**
+ * Names of the event log sources.
+ */
+static const char LOG_SOURCE_NAMES[ELFI::LOG_SOURCES][9] __PROGMEM = {
+  "sketch", "boot", "activity", "web", "udp"
+};
+
+void
+ELFI::WebServer::on_log(ELFI* elfi, IOStream& page, char* method, char* path, char* query)
+{
+  static const char header[] __PROGMEM =
+    "HTTP/1.1 200 OK" CRLF
+    "Content-Type: text/plain" CRLF
+    "Connection: close" CRLF CRLF;
+  static const char csv_header[] __PROGMEM =
+    "HTTP/1.1 200 OK" CRLF
+    "Content-Type: text/csv" CRLF
+    "Connection: close" CRLF CRLF
+    "time,source,device,mode" CRLF;
+  
+  UNUSED(method);
+  if (strcmp_P(path, LOG_PATH) != 0)
+  {
+    reply(page, 404);
+    return;
+  }
+  
+  bool csv = (query != NULL) && (strcmp_P(query, CSV_QUERY) == 0);
+  page << (str_P) (csv ? csv_header : header);
+  
+  // The entries loaded from EEPROM and the entries since start are two time
+  // lines; each anchored at the time of its newest entry. Find the time of
+  // the first entry of each time line
+  uint8_t count = elfi->m_log_count;
+  uint8_t loaded = elfi->m_log_loaded;
+  uint8_t first = (elfi->m_log_head + LOG_ENTRIES - count) % LOG_ENTRIES;
+  clock_t loaded_clock = elfi->m_log_loaded_clock;
+  clock_t clock = elfi->m_log_clock;
+  for (uint8_t nr = 1; nr < count; nr++)
+  {
+    if (nr == loaded) continue;
+    uint32_t seconds = log_seconds(elfi->m_log[(first + nr) % LOG_ENTRIES].delta);
+    if (nr < loaded) loaded_clock -= seconds; else clock -= seconds;
+  }
+  
+  // Decode and print the entries, oldest first
+  clock_t time = 0L;
+  for (uint8_t nr = 0; nr < count; nr++)
+  {
+    const log_entry_t & entry = elfi->m_log[(first + nr) % LOG_ENTRIES];
+    if (nr == 0) time = (loaded > 0) ? loaded_clock : clock;
+    else if (nr == loaded) time = clock;
+    else time += log_seconds(entry.delta);
+    
+    uint8_t source = entry.source_device >> 5;
+    uint8_t device = entry.source_device & LOG_NO_DEVICE;
+    char sep = csv ? ',' : ' ';
+    page << time_t(time) << sep;
+    if (source < LOG_SOURCES) page << (str_P) LOG_SOURCE_NAMES[source]; else page << source;
+    page << sep;
+    if (device == LOG_NO_DEVICE) page << '-';
+    else if (device == NEXA_SWITCHES) page << PSTR("all");
+    else if (device >= LOG_ACTIVITY_DEVICE) page << PSTR("activity") << (uint8_t) (device - LOG_ACTIVITY_DEVICE);
+    else page << device;
+    page << sep << (int) entry.mode << endl;
+  }
+}
+
+void
+ELFI::WebServer::on_icon(ELFI* elfi, IOStream& page, char* method, char* path, char* query)
+{
+  UNUSED(elfi);
+  UNUSED(method);
+  UNUSED(path);
+  UNUSED(query);
+  reply(page, 204);
 }
 
 /**
@@ -277,186 +1432,193 @@ ELFI::NEXAActivity::run()
  * https://github.com/mikaelpatel/Cosa/tree/master/examples/Ethernet/CosaPinWebServer
  */
 void 
-ELFI::WebServer::on_request(IOStream& page, char* method, char* path, char* query)
+ELFI::WebServer::render(IOStream& page)
 {
-  if (query != NULL)
-  {
-    handle_query(query);
-  }
-  else
-  {
-    static const char header[] __PROGMEM = 
-      "HTTP/1.1 200 OK" CRLF
-      "Content-Type: text/html" CRLF
-      "Connection: close" CRLF CRLF
-      "<!DOCTYPE HTML>" CRLF
-      "<html>" CRLF
-      "<head>" CRLF
-      "<meta charset=\"UTF-8\">"
-      "<meta name='apple-mobile-web-app-capable' content='yes' />" CRLF
-      "<meta name='apple-mobile-web-app-status-bar-style' content='black' />" CRLF
-      "<meta name='apple-mobile-web-app-title' content='Home Automation System' />" CRLF
-      "<meta name='viewport' content='width=device-width, initial-scale=1, user-scalable = no'>" CRLF
-      "<script src=\"//ajax.googleapis.com/ajax/libs/jquery/1.8.3/jquery.min.js\"></script>" CRLF
-      "<script>" CRLF
-      "  function deviceControll(url) {$.ajax(url);}" CRLF
-      "</script>" CRLF
-      "<script>" CRLF
-      "  $(document).ready(function(){" CRLF
-      "    $('.toggle').click(function(){" CRLF
-      "      $('div div').toggle();" CRLF
-      "      $('div div:first-child').show();" CRLF
-      "    });" CRLF
-      "  });" CRLF
-      "</script>" CRLF
-      "<style>" CRLF
-      "body{margin:0; font-family:Helvetica,Arial,Sans-Serif; font-size:14px; background:#CCC; box-sizing:border-box;}" CRLF
-      "*, *:before, *:after {box-sizing: inherit;}" CRLF
-      "h1,h2,h3{display: block; padding:6px; margin:0;}" CRLF
-      "h1{background:#67D66F; color: white;}" CRLF
-      "h2, h3{padding-left:0px;}" CRLF
-      "h3{font-size:15px}" CRLF
-      ".button{display:table-cell; width:20%; height:inherit; vertical-align:middle; text-align:center;}" CRLF
-      ".devices .device:first-child{background:#9CEF9F; color: white; margin-bottom:0;}" CRLF
-      ".group {border-bottom:2px solid #67D66F}" CRLF
-      ".group H2, .group H3{display:table-cell; width:60%; height:inherit; vertical-align:middle;}" CRLF
-      ".group-header, .group-item{display:table; width:100%; height:20px; background:white; padding:6px; margin-bottom:1px}" CRLF
-      ".group-header{background:#9CEF9F; color: white; margin-bottom:0;}"CRLF
-      ".group-item{display:table; width:100%; height:20px; background:white; padding:6px; margin-bottom:1px}" CRLF
-      ".group-item:last-child{margin-bottom:0px}" CRLF
-      ".group-item span{vertical-align:middle; display:table-cell;}" CRLF
-      ".group button{background:#67D66F; padding:5px 10px; margin: auto; border:hidden; -webkit-border-radius:3px; -moz-border-radius:3px; border-radius:3px; color:white; vertical-align:middle; min-width:95%;}" CRLF
-      "div#time{color:gray; padding:8px; font-size:10px}" CRLF
-      "</style>" CRLF
-      "<title>ElFI - Home Automation System</title>" CRLF
-      "</head>" CRLF 
-      "<body>" CRLF;
-      
-    static const char body[] __PROGMEM = 
-      "<h1>ElFi</h1>" CRLF;
-      
-    // Construct the NEXA Switches part of body
-    static const char body_NEXASwitch0[] __PROGMEM =
-      "<div class=\"group\">" CRLF
-      "<div class=\"group-header\">" CRLF
-      "<h2>NEXA Switches</h2>" CRLF
-      "<div class=\"button\">" CRLF
-      "<button onclick=\"deviceControll('http://10.0.1.190/?switch_all=1');\">All on</button>" CRLF
-      "</div>" CRLF
-      "<div class=\"button\">" CRLF
-      "<button onclick=\"deviceControll('http://10.0.1.190/?switch_all=0');\">All off</button>" CRLF
-      "</div>" CRLF
-      "</div>" CRLF
-      "<div class=\"group-items\">" CRLF;
-    
-    static const char body_NEXASwitch1[] __PROGMEM = 
-      "<div class=\"group-item\">" CRLF
-      "<h3>";
-      
-    static const char body_NEXASwitch2[] __PROGMEM = 
-      "</h3>" CRLF
-      "<div class=\"button\">" CRLF
-      "<button onclick=\"deviceControll('http://10.0.1.190/?switch=";
-      
-    static const char body_NEXASwitch3[] __PROGMEM = 
-      ",1');\">On</button>" CRLF
-      "</div>" CRLF
-      "<div class=\"button\">" CRLF
-      "<button onclick=\"deviceControll('http://10.0.1.190/?switch=";
-      
-    static const char body_NEXASwitch4[] __PROGMEM = 
-      ",0');\">Off</button>" CRLF
-      "</div>" CRLF
-      "</div>" CRLF;
-      
-    // Construct the NEXA Switches part of body
-    static const char body_NEXAActivity0[] __PROGMEM =
-      "<div class=\"group\">" CRLF
-      "<div class=\"group-header\">" CRLF
-      "<h2>NEXA Activities</h2>" CRLF
-      "</div>" CRLF
-      "<div class=\"group-items\">" CRLF;
-    
-    static const char body_NEXAActivity1[] __PROGMEM = 
-      "<div class=\"group-item\">" CRLF
-      "<h3>";
-      
-    static const char body_NEXAActivity2[] __PROGMEM = 
-      "</h3>" CRLF
-      "<span>" CRLF;
-      
-    static const char body_NEXAActivity3[] __PROGMEM = 
-      "</span>" CRLF
-      "</div>" CRLF;
-    
-    // Construct end div
-    static const char body_enddiv[] __PROGMEM = 
-      "</div>";
-      
-    static const char groupscript[] __PROGMEM = 
+  static const char header[] __PROGMEM = 
+    "HTTP/1.1 200 OK" CRLF
+    "Content-Type: text/html" CRLF
+    "Connection: close" CRLF CRLF
+    "<!DOCTYPE HTML>" CRLF
+    "<html>" CRLF
+    "<head>" CRLF
+    "<meta charset=\"UTF-8\">"
+    "<meta name='apple-mobile-web-app-capable' content='yes' />" CRLF
+    "<meta name='apple-mobile-web-app-status-bar-style' content='black' />" CRLF
+    "<meta name='apple-mobile-web-app-title' content='Home Automation System' />" CRLF
+    "<meta name='viewport' content='width=device-width, initial-scale=1, user-scalable = no'>" CRLF
+    "<script src=\"//ajax.googleapis.com/ajax/libs/jquery/1.8.3/jquery.min.js\"></script>" CRLF
     "<script>" CRLF
-    "  function handler( event ) {" CRLF
-    "    var target = $( event.target );" CRLF
-    "    target.parent().parent().find( '.group-items' ).toggle();" CRLF
-    "  }" CRLF
-    "  $( '.group-header' ).click( handler ).parent().find('.group-items').hide();" CRLF
-    "  $( '.group' ).first().find('.group-items').show();" CRLF
-    "</script>" CRLF;
-    
-    // Construct footer
-    static const char footer[] __PROGMEM = 
-      "</body>" CRLF 
-      "</html>";
-    
-    // Print the header and start of body
-    page << (str_P) header;
-    page << (str_P) body;
+    "  function deviceControll(url) {$.ajax(url);}" CRLF
+    "</script>" CRLF
+    "<script>" CRLF
+    "  $(document).ready(function(){" CRLF
+    "    $('.toggle').click(function(){" CRLF
+    "      $('div div').toggle();" CRLF
+    "      $('div div:first-child').show();" CRLF
+    "    });" CRLF
+    "  });" CRLF
+    "</script>" CRLF
+    "<style>" CRLF
+    "body{margin:0; font-family:Helvetica,Arial,Sans-Serif; font-size:14px; background:#CCC; box-sizing:border-box;}" CRLF
+    "*, *:before, *:after {box-sizing: inherit;}" CRLF
+    "h1,h2,h3{display: block; padding:6px; margin:0;}" CRLF
+    "h1{background:#67D66F; color: white;}" CRLF
+    "h2, h3{padding-left:0px;}" CRLF
+    "h3{font-size:15px}" CRLF
+    ".button{display:table-cell; width:20%; height:inherit; vertical-align:middle; text-align:center;}" CRLF
+    ".devices .device:first-child{background:#9CEF9F; color: white; margin-bottom:0;}" CRLF
+    ".group {border-bottom:2px solid #67D66F}" CRLF
+    ".group H2, .group H3{display:table-cell; width:60%; height:inherit; vertical-align:middle;}" CRLF
+    ".group-header, .group-item{display:table; width:100%; height:20px; background:white; padding:6px; margin-bottom:1px}" CRLF
+    ".group-header{background:#9CEF9F; color: white; margin-bottom:0;}"CRLF
+    ".group-item{display:table; width:100%; height:20px; background:white; padding:6px; margin-bottom:1px}" CRLF
+    ".group-item:last-child{margin-bottom:0px}" CRLF
+    ".group-item span{vertical-align:middle; display:table-cell;}" CRLF
+    ".group button{background:#67D66F; padding:5px 10px; margin: auto; border:hidden; -webkit-border-radius:3px; -moz-border-radius:3px; border-radius:3px; color:white; vertical-align:middle; min-width:95%;}" CRLF
+    "div#time, div#boot{color:gray; padding:8px; font-size:10px}" CRLF
+    "</style>" CRLF
+    "<title>ElFI - Home Automation System</title>" CRLF
+    "</head>" CRLF 
+    "<body>" CRLF;
     
-    // Print NEXA Switches
-    page << (str_P) body_NEXASwitch0;
+  static const char body[] __PROGMEM = 
+    "<h1>ElFi</h1>" CRLF;
     
-    for (int id = 0; id < NEXA_SWITCHES; id++)
-    {    
-      if(m_parent->m_switch_activated[id]) {
-        page << (str_P) body_NEXASwitch1
-             << m_parent->m_switch_name[id].c_str()
-             << (str_P) body_NEXASwitch2
-             << id
-             << (str_P) body_NEXASwitch3
-             << id
-             << (str_P) body_NEXASwitch4;
-      }
-    }
+  // Construct the NEXA Switches part of body
+  static const char body_NEXASwitch0[] __PROGMEM =
+    "<div class=\"group\">" CRLF
+    "<div class=\"group-header\">" CRLF
+    "<h2>NEXA Switches</h2>" CRLF
+    "<div class=\"button\">" CRLF
+    "<button onclick=\"deviceControll('http://10.0.1.190/?switch_all=1');\">All on</button>" CRLF
+    "</div>" CRLF
+    "<div class=\"button\">" CRLF
+    "<button onclick=\"deviceControll('http://10.0.1.190/?switch_all=0');\">All off</button>" CRLF
+    "</div>" CRLF
+    "</div>" CRLF
+    "<div class=\"group-items\">" CRLF;
+  
+  static const char body_NEXASwitch1[] __PROGMEM = 
+    "<div class=\"group-item\">" CRLF
+    "<h3>";
     
-    page << (str_P) body_enddiv << endl << (str_P) body_enddiv << endl;
+  static const char body_NEXASwitch2[] __PROGMEM = 
+    "</h3>" CRLF
+    "<div class=\"button\">" CRLF
+    "<button onclick=\"deviceControll('http://10.0.1.190/?switch=";
     
-    // Print NEXA Activities
-    page << (str_P) body_NEXAActivity0;
+  static const char body_NEXASwitch3[] __PROGMEM = 
+    ",1');\">On</button>" CRLF
+    "</div>" CRLF
+    "<div class=\"button\">" CRLF
+    "<button onclick=\"deviceControll('http://10.0.1.190/?switch=";
     
-    for (int id = 0; id < NEXA_ACTIVITIES; id++)
-    {    
-      if(m_parent->m_activities[id].m_activated) {
-        page << (str_P) body_NEXAActivity1
-             << m_parent->m_activities[id].m_name.c_str()
-             << (str_P) body_NEXAActivity2
-             << m_parent->m_activities[id].m_hours << PSTR(":")
-             << m_parent->m_activities[id].m_minutes
-             << (str_P) body_NEXAActivity3;
-      }
-    }
+  static const char body_NEXASwitch4[] __PROGMEM = 
+    ",0');\">Off</button>" CRLF
+    "</div>" CRLF
+    "</div>" CRLF;
     
-    page << (str_P) body_enddiv << endl << (str_P) body_enddiv << endl;
+  // Construct the NEXA Switches part of body
+  static const char body_NEXAActivity0[] __PROGMEM =
+    "<div class=\"group\">" CRLF
+    "<div class=\"group-header\">" CRLF
+    "<h2>NEXA Activities</h2>" CRLF
+    "</div>" CRLF
+    "<div class=\"group-items\">" CRLF;
+  
+  static const char body_NEXAActivity1[] __PROGMEM = 
+    "<div class=\"group-item\">" CRLF
+    "<h3>";
     
-    // Print time
-    time_t time = RTC::time();
-    page << PSTR("<div id =\"time\">Time: ") << time << PSTR("</div>") << endl;
+  static const char body_NEXAActivity2[] __PROGMEM = 
+    "</h3>" CRLF
+    "<span>" CRLF;
     
-    // Print group script
-    page << (str_P) groupscript;
+  static const char body_NEXAActivity3[] __PROGMEM = 
+    "</span>" CRLF
+    "</div>" CRLF;
+  
+  // Construct end div
+  static const char body_enddiv[] __PROGMEM = 
+    "</div>";
     
-    // Print footer
-    page << (str_P) footer;
+  static const char groupscript[] __PROGMEM = 
+  "<script>" CRLF
+  "  function handler( event ) {" CRLF
+  "    var target = $( event.target );" CRLF
+  "    target.parent().parent().find( '.group-items' ).toggle();" CRLF
+  "  }" CRLF
+  "  $( '.group-header' ).click( handler ).parent().find('.group-items').hide();" CRLF
+  "  $( '.group' ).first().find('.group-items').show();" CRLF
+  "</script>" CRLF;
+  
+  // Construct footer
+  static const char footer[] __PROGMEM = 
+    "</body>" CRLF 
+    "</html>";
+  
+  // Print the header and start of body
+  page << (str_P) header;
+  page << (str_P) body;
+  
+  // Print NEXA Switches
+  page << (str_P) body_NEXASwitch0;
+  
+  for (int id = 0; id < NEXA_SWITCHES; id++)
+  {    
+    if(m_parent->m_switch_activated[id]) {
+      page << (str_P) body_NEXASwitch1
+           << m_parent->m_switch_name[id].c_str()
+           << (str_P) body_NEXASwitch2
+           << id
+           << (str_P) body_NEXASwitch3
+           << id
+           << (str_P) body_NEXASwitch4;
+    }
+  }
+  
+  page << (str_P) body_enddiv << endl << (str_P) body_enddiv << endl;
+  
+  // Let due activities run
+  m_parent->dispatch();
+  
+  // Print NEXA Activities
+  page << (str_P) body_NEXAActivity0;
+  
+  for (int id = 0; id < NEXA_ACTIVITIES; id++)
+  {    
+    if(m_parent->m_activities[id].m_activated) {
+      page << (str_P) body_NEXAActivity1
+           << m_parent->m_activities[id].m_name.c_str()
+           << (str_P) body_NEXAActivity2
+           << m_parent->m_activities[id].m_hours << PSTR(":")
+           << m_parent->m_activities[id].m_minutes;
+      if (!m_parent->m_activities[id].m_enabled) page << PSTR(" (disabled)");
+      page << (str_P) body_NEXAActivity3;
+    }
   }
+  
+  page << (str_P) body_enddiv << endl << (str_P) body_enddiv << endl;
+  
+  // Print time
+  time_t time = RTC::time();
+  page << PSTR("<div id =\"time\">Time: ") << time
+       << PSTR(", lateness: ") << m_parent->m_lateness
+       << '/' << m_parent->m_lateness_max << PSTR(" s</div>") << endl;
+  
+  // Print boot stage times
+  page << PSTR("<div id =\"boot\">Boot:");
+  for (uint8_t stage = 0; stage < m_parent->m_boot_stage && stage < BOOT_STAGES; stage++)
+  {
+    page << ' ' << m_parent->m_boot_time[stage];
+  }
+  page << PSTR(" ms</div>") << endl;
+  
+  // Print group script
+  page << (str_P) groupscript;
+  
+  // Print footer
+  page << (str_P) footer;
 }
 
 void
@@ -465,6 +1627,9 @@ ELFI::WebServer::handle_query(char* query)
   String toparse = query;
   String keyval, key, val;
   
+  // Log switch commands as from the web server
+  m_parent->m_log_source = LOG_WEB;
+  
   while (toparse.length() > 0)
   {
     if (toparse.indexOf('&') > 0) {
@@ -476,6 +1641,8 @@ ELFI::WebServer::handle_query(char* query)
     key = keyval.substring(0, keyval.indexOf('='));
     val = keyval.substring(keyval.indexOf('=')+1);
     
+    // Commands that are not handled are logged as dropped
+    bool handled = false;
     if (key.equals("switch"))
     {
       int id = val.substring(0, val.indexOf(',')).toInt();
@@ -485,10 +1652,12 @@ ELFI::WebServer::handle_query(char* query)
         if (mode == 0)
         {
           m_parent->switch_off(id);
+          handled = true;
         }
         else if (mode == 1)
         {
           m_parent->switch_on(id);
+          handled = true;
         }
       }
     }
@@ -498,13 +1667,31 @@ ELFI::WebServer::handle_query(char* query)
       if (mode == 0)
       {
         m_parent->switch_off();
+        handled = true;
       }
       else if (mode == 1)
       {
         m_parent->switch_on();
+        handled = true;
       }
     }
     
+    if (key.equals("activity"))
+    {
+      int id = val.substring(0, val.indexOf(',')).toInt();
+      if (id >= 0 && id < NEXA_ACTIVITIES)
+      {
+        int enable = val.substring(val.indexOf(',')+1).toInt();
+        if (m_parent->enable_NEXA_Activity(id, enable != 0))
+        {
+          m_parent->log(LOG_WEB, LOG_ACTIVITY_DEVICE + id, enable != 0);
+          handled = true;
+        }
+      }
+    }
+    
+    if (!handled) m_parent->log(LOG_WEB, LOG_NO_DEVICE, 0);
+    
     //TODO: Implement parsing for NEXASwitch::switch_dim(int_t dim)
     
     if (toparse.indexOf('&') > 0) {
@@ -513,4 +1700,6 @@ ELFI::WebServer::handle_query(char* query)
       toparse = "";
     }
   }
+  
+  m_parent->m_log_source = LOG_SKETCH;
 }
@@ -3,6 +3,7 @@
 
 #include "Cosa/Activity.hh"
 #include "Cosa/Driver/NEXA.hh"
+#include "Cosa/EEPROM.hh"
 #include "Cosa/Event.hh"
 #include "Cosa/INET/DNS.hh"
 #include "Cosa/INET/HTTP.hh"
@@ -14,6 +15,7 @@
 // Web server settings =========================================================
 #define CRLF "\r\n"                         // HTML end of line
 #define WEBSERVER_PORT 80                   // Web server port
+#define WEBSERVER_HANDLERS 4                // Max number of sketch request handlers
 // -----------------------------------------------------------------------------
 
 // NEXA settings ===============================================================
@@ -36,6 +38,85 @@
 #define NTP_SERVER "se.pool.ntp.org"
 // -----------------------------------------------------------------------------
 
+// Journal settings ============================================================
+// EEPROM address where the journal of switch states and configuration
+// changes begins.
+#define JOURNAL_EEPROM_START 0
+
+// Number of records in the journal. Each record uses 9 bytes of EEPROM. The
+// journal must be able to hold two complete snapshots of the state.
+#define JOURNAL_RECORDS 56
+
+// Interval in seconds between records of the current time. The latest
+// recorded time is used as start time until the NTP has been reached.
+#define JOURNAL_CLOCK_PERIOD 3600
+
+#if (JOURNAL_RECORDS > 254) || (JOURNAL_RECORDS < 2 * (2 + NEXA_SWITCHES + NEXA_ACTIVITIES))
+#error "JOURNAL_RECORDS must hold two snapshots and may not exceed 254"
+#endif
+// -----------------------------------------------------------------------------
+
+// Event log settings ==========================================================
+// Number of entries in the event log of switch commands, activity dispatch
+// and clock updates. Each entry uses 4 bytes of dynamic memory.
+#define LOG_ENTRIES 32
+
+// Number of the latest event log entries also kept in EEPROM to survive a
+// restart. Each entry uses 9 bytes of EEPROM. Set to 0 to disable.
+#define LOG_EEPROM_ENTRIES 0
+
+// EEPROM address of the event log entries; default is after the journal.
+#define LOG_EEPROM_START (JOURNAL_EEPROM_START + JOURNAL_RECORDS * sizeof(ELFI::Journal::record_t))
+
+#if (LOG_ENTRIES < 1) || (LOG_ENTRIES > 255) || (LOG_EEPROM_ENTRIES > 254)
+#error "LOG_ENTRIES must be 1..255 and LOG_EEPROM_ENTRIES may not exceed 254"
+#endif
+
+#if (NEXA_SWITCHES + 1 + NEXA_ACTIVITIES > 31)
+#error "The event log device field holds at most 30 NEXA switches and activities"
+#endif
+// -----------------------------------------------------------------------------
+
+// Fade settings ===============================================================
+// Maximum number of concurrent fades. Switches fading alike share a fade.
+// Each fade uses 12 bytes of dynamic memory.
+#define FADES 4
+
+// Time slot in milliseconds for each RF frame sent by the fades. One frame
+// is sent per slot; the dimable switches being faded take turns.
+#define FADE_SLOT 250L
+// -----------------------------------------------------------------------------
+
+// Sun settings ================================================================
+// Location used to compute sunrise and sunset for activities triggered by
+// the sun. Given in hundredths of a degree; north and east are positive.
+// 5933, 1807 : Stockholm
+#define SUN_LATITUDE 5933
+#define SUN_LONGITUDE 1807
+// -----------------------------------------------------------------------------
+
+// Scheduler settings ==========================================================
+// ELFI::run() serves, in order of priority, activities and watchdog events,
+// HTTP requests and background work such as the network boot. A dispatch is
+// late by at most the time to serve one request, as requests are deferred
+// SCHEDULER_HTTP_GUARD seconds before an activity. The boot stages block;
+// they are started no later than SCHEDULER_BOOT_GUARD seconds before an
+// activity and NTP retries stop when one is due, but DHCP and DNS must
+// complete within SCHEDULER_BOOT_GUARD seconds to keep the bound.
+#define SCHEDULER_BUDGET 20L                // Time budget per run (ms); background work is deferred when spent
+#define SCHEDULER_HTTP_WAIT 5L              // Max time to wait for a HTTP request (ms)
+#define SCHEDULER_HTTP_GUARD 2              // Defer HTTP requests when an activity is due within seconds
+#define SCHEDULER_BOOT_GUARD 30             // Defer background work when an activity is due within seconds
+#define SCHEDULER_HTTP_LOAD 4               // Max HTTP requests handled per second; others get 503
+// -----------------------------------------------------------------------------
+
+// Boot settings ===============================================================
+// Delay in milliseconds before a failed network boot stage is retried. The
+// delay is doubled for each failure up to BOOT_RETRY_MAX.
+#define BOOT_RETRY_MIN 1000L
+#define BOOT_RETRY_MAX 64000L
+// -----------------------------------------------------------------------------
+
 // Weekday alarm settings ======================================================
 // Common days of the week to dispatch a alarm on. The alarm will be dispatched
 // on all true days and not on all false days.
@@ -49,6 +130,52 @@ static const bool WEEKENDDAYS[7] __PROGMEM = { true, false, false, false, false,
 class ELFI
 {
   public:
+    /**
+     * Boot stages in the order they are run. The NEXA transmitter and the
+     * activities are started by begin(); the network stages are run in the
+     * background by run().
+     */
+    enum {
+      BOOT_RESTORE = 0,   //<! Restore switch states from the journal.
+      BOOT_SCHEDULER,     //<! Start the activities from the last known time.
+      BOOT_DHCP,          //<! Retrieve a LAN IP using DHCP.
+      BOOT_WEBSERVER,     //<! Open the web server socket.
+      BOOT_NTP,           //<! Set the clock using a NTP.
+      BOOT_STAGES         //<! Number of boot stages; boot completed.
+    };
+    
+    /**
+     * HTTP request handler. The handler writes the complete response,
+     * including the status line, to the page.
+     * @param[in] elfi object receiving the request
+     * @param[in] page iostream for response
+     * @param[in] method http request method string
+     * @param[in] path resource path string; may continue past the
+     * registered prefix
+     * @param[in] query possible query string; NULL if none
+     */
+    typedef void (*Handler)(ELFI* elfi, IOStream& page, char* method, char* path, char* query);
+    
+    /**
+     * Sources of event log entries.
+     */
+    enum {
+      LOG_SKETCH = 0,     //<! Command from the sketch.
+      LOG_BOOT,           //<! Start or restore on start.
+      LOG_ACTIVITY,       //<! Activity dispatch.
+      LOG_WEB,            //<! Command from the web server.
+      LOG_UDP,            //<! Clock update from NTP.
+      LOG_SOURCES         //<! Number of sources.
+    };
+    
+    /**
+     * Sun events that may trigger an activity.
+     */
+    enum Trigger {
+      SUNRISE = 1,        //<! Dispatch relative to sunrise.
+      SUNSET = 2          //<! Dispatch relative to sunset.
+    };
+    
     /**
      * Default constructor.
      */
@@ -56,11 +183,18 @@ class ELFI
       m_transmitter(NULL),
       m_ethernet(NULL),
       m_webserverflag(false),
-      m_webserver(this)
+      m_webserver(this),
+      m_journal(JOURNAL_EEPROM_START, JOURNAL_RECORDS)
+#if LOG_EEPROM_ENTRIES > 0
+      , m_log_spill(LOG_EEPROM_START, LOG_EEPROM_ENTRIES)
+#endif
     { initialize(); };
     
     /**
-     * Start ElFi based on the settings provided.
+     * Start ElFi based on the settings provided. The NEXA switches are
+     * restored and the activities are started from the last known time
+     * before returning; the network is brought up in the background by
+     * run(). Returns false if no transmitter is given otherwise true.
      * @param[in] transmitter to use
      * @param[in] ethernet socket to use (optional)
      * @param[in] webserverflag true if HTTP acces to ElFi should be used; default false (optional)
@@ -72,6 +206,43 @@ class ELFI
      */
     int run();
     
+    /**
+     * Returns the current boot stage; BOOT_STAGES when boot is completed.
+     * @return boot stage
+     */
+    uint8_t boot_stage() const { return (m_boot_stage); }
+    
+    /**
+     * Returns the time in milliseconds a boot stage took to complete,
+     * including failed attempts, or zero if not yet completed.
+     * @param[in] stage boot stage
+     * @return milliseconds
+     */
+    uint32_t boot_time(uint8_t stage) const
+    {
+      return (stage < BOOT_STAGES ? m_boot_time[stage] : 0L);
+    }
+    
+    /**
+     * Register a handler for HTTP requests. A request is handled by the first
+     * handler with matching method and path prefix; the path matches if it
+     * equals the prefix or continues with '/'. The built-in handlers take
+     * precedence. Returns true if registered otherwise false; at most
+     * WEBSERVER_HANDLERS handlers may be registered.
+     * @param[in] method request method in program memory, e.g. PSTR("GET"); NULL for any
+     * @param[in] path prefix in program memory, e.g. PSTR("/temp")
+     * @param[in] handler function
+     */
+    bool register_handler(str_P method, str_P path, Handler handler);
+    
+    /**
+     * Write a response without content. Used by request handlers.
+     * @param[in] page iostream for response
+     * @param[in] status 204 (No Content), 503 (Service Unavailable) or
+     * otherwise 404 (Not Found)
+     */
+    static void reply(IOStream& page, uint16_t status);
+    
     /**
      * Activates a NEXA switch. Returns true if successfull
      * activataion otherwise false. ElFi can control up to NEXA_SWITCHES
@@ -104,6 +275,41 @@ class ELFI
      */
     bool activate_NEXA_Activity(uint8_t id, String str, const bool (&d)[7], uint8_t h, uint8_t m, uint8_t mode, uint8_t sid = NEXA_SWITCHES);
     
+    /**
+     * Activates a NEXA activity dispatched relative to sunrise or sunset at
+     * SUN_LATITUDE and SUN_LONGITUDE. The time of dispatch is recomputed
+     * once a day. See activate_NEXA_Activity() above for the conditions of
+     * activation.
+     * @param[in] id number for NEXA activity (0-based)
+     * @param[in] str NEXA activity name
+     * @param[in] d days to dispatch activity on
+     * @param[in] trigger SUNRISE or SUNSET
+     * @param[in] offset minutes after (positive) or before (negative) trigger
+     * @param[in] mode to switch to at dispatch
+     * @param[in] sid ID of NEXA Switch to be switched; if no value is provided, all NEXA Switches are switched to given mode
+     */
+    bool activate_NEXA_Activity(uint8_t id, String str, const bool (&d)[7], Trigger trigger, int16_t offset, uint8_t mode, uint8_t sid = NEXA_SWITCHES);
+    
+    /**
+     * Enables or disables a previously activated NEXA activity. A disabled
+     * activity is not dispatched. The change is stored in the journal and
+     * survives a restart. Returns true if successful otherwise false.
+     * @param[in] id number for NEXA activity (0-based)
+     * @param[in] enable true to enable, false to disable
+     */
+    bool enable_NEXA_Activity(uint8_t id, bool enable);
+    
+    /**
+     * Let a previously activated NEXA activity fade its dimable switches to
+     * the activity mode instead of switching directly, e.g. for a wake-up
+     * light. See fade(). An activity for all switches switches the other
+     * switches one per fade slot. Returns true if successful otherwise false.
+     * @param[in] id number for NEXA activity (0-based)
+     * @param[in] from mode to start the fade from: 0 for OFF, 1 for ON and (-15 ...-1) for dim level
+     * @param[in] seconds duration of the fade; 0 to switch directly
+     */
+    bool fade_NEXA_Activity(uint8_t id, int8_t from, uint16_t seconds);
+    
     /**
      * Switch the power switch to given mode.
      * @section Reference
@@ -157,6 +363,20 @@ class ELFI
      * https://github.com/mikaelpatel/Cosa/blob/master/cores/cosa/Cosa/Driver/NEXA.hh
      */
     void switch_off();
+    
+    /**
+     * Fade dimable power switches from one mode to another over given time.
+     * The fade does not block; one RF frame is sent per FADE_SLOT from run().
+     * A fade of a switch replaces any ongoing fade of that switch, unless it
+     * has the same modes and duration, and a command to the switch stops it.
+     * Returns true if the fade was started or is running otherwise false; no
+     * dimable switch or no free fade.
+     * @param[in] id for the NEXA Switch; NEXA_SWITCHES for all dimable switches
+     * @param[in] from mode: 0 for OFF, 1 for ON and (-15 ...-1) for dim level
+     * @param[in] to mode: 0 for OFF, 1 for ON and (-15 ...-1) for dim level
+     * @param[in] seconds duration of the fade
+     */
+    bool fade(uint8_t id, int8_t from, int8_t to, uint16_t seconds);
   
   private:
     /**
@@ -186,13 +406,27 @@ class ELFI
          */
         void enable();
         
+        /**
+         * Returns the most recent time, not later than the given time, the
+         * activity should have been dispatched. Looks back at most one week.
+         * @param[in] now time to look back from
+         * @return clock or 0L if no dispatch within the last week
+         */
+        clock_t last_dispatch(clock_t now);
+        
       protected:
         NEXAActivity() :
+          Activity(),
           m_parent(NULL),
           m_id(NEXA_ACTIVITIES),
+          m_trigger(0),
+          m_offset(0),
+          m_fade_from(0),
+          m_fade(0),
           m_switch(NEXA_SWITCHES),
           m_activated(false),
-          Activity()
+          m_enabled(true),
+          m_dispatched(0L)
         {
           set_run_period(1);
         };
@@ -201,12 +435,124 @@ class ELFI
         ELFI *    m_parent;     //<! NEXA activity parent.
         uint8_t   m_id;         //<! NEXA activity id number.
         String    m_name;       //<! NEXA activity name.
-        bool      m_days[7];    //<! Days to dispatch activity.
+        bool      m_days[7];    //<! Days to dispatch activity; Sunday first.
         uint8_t   m_hours;      //<! Hour to dispatch activity.
         uint8_t   m_minutes;    //<! Minute to dispatch activity.
+        uint8_t   m_trigger;    //<! Sun trigger or zero for fixed time.
+        int16_t   m_offset;     //<! Minutes from sun trigger.
+        int8_t    m_fade_from;  //<! Mode to fade from.
+        uint16_t  m_fade;       //<! Seconds to fade; zero to switch directly.
         uint8_t   m_mode;       //<! Mode to switch to on dispath.
         uint8_t   m_switch;     //<! NEXA Switch to switch mode for on dispatch
         bool      m_activated;  //<! If activated.
+        bool      m_enabled;    //<! If enabled, i.e. dispatched when due.
+        clock_t   m_dispatched; //<! Due time of latest dispatch.
+    };
+    
+    /**
+     * Append-only journal of switch states and configuration changes kept in
+     * EEPROM. The records are written as a ring buffer so that the writes
+     * are spread over the whole journal area (wear-leveling). Each record
+     * carries a sequence number, used to find the newest record on start,
+     * and a checksum, used to ignore records torn by a power cut.
+     *
+     * The journal is compacted by ELFI::compact() when full; a snapshot of
+     * the complete state is appended so that older records may be
+     * overwritten.
+     */
+    class Journal
+    {
+      public:
+        /** Record types. */
+        enum {
+          SNAPSHOT_RECORD = 1,  //<! Start of snapshot; value is number of records following.
+          SWITCH_RECORD = 2,    //<! Commanded NEXA switch mode.
+          ACTIVITY_RECORD = 3,  //<! NEXA activity enabled or disabled.
+          CLOCK_RECORD = 4,     //<! Current time.
+          ESTIMATED = 0x80      //<! Flag; clock was estimated from the journal.
+        };
+        
+        /** Journal record as stored in EEPROM. */
+        struct record_t {
+          uint8_t seq;          //<! Sequence number; 0xff if unused.
+          uint8_t type;         //<! Record type.
+          uint8_t id;           //<! NEXA switch or activity id.
+          int8_t value;         //<! Mode or flag.
+          clock_t clock;        //<! Time of change or 0L if unknown.
+          uint8_t check;        //<! Checksum.
+        };
+        
+        /**
+         * Construct journal in given EEPROM area.
+         * @param[in] start EEPROM address of the journal
+         * @param[in] records number of records in the journal (1..254)
+         */
+        Journal(uint16_t start, uint8_t records) :
+          m_start((record_t*) start),
+          m_records(records),
+          m_head(0),
+          m_count(0),
+          m_seq(0)
+        {};
+        
+        /**
+         * Scan the journal in EEPROM for the newest record. Returns the number
+         * of records in the journal.
+         * @return number of records
+         */
+        uint8_t begin();
+        
+        /**
+         * Read a record. Records are numbered from the oldest (0) to the
+         * newest (count - 1). Returns true if the record is valid otherwise
+         * false.
+         * @param[in] nr record number
+         * @param[out] rec record
+         */
+        bool read(uint8_t nr, record_t& rec);
+        
+        /**
+         * Append a record to the journal, overwriting the oldest record if
+         * the journal is full.
+         * @param[in] type of record
+         * @param[in] id number for NEXA switch or activity
+         * @param[in] value of record
+         * @param[in] clock time of change
+         */
+        void append(uint8_t type, uint8_t id, int8_t value, clock_t clock);
+        
+      private:
+        /**
+         * Returns EEPROM address of given journal slot.
+         * @param[in] ix slot index
+         */
+        record_t* address(uint8_t ix)
+        {
+          return (m_start + ix);
+        }
+        
+        /**
+         * Returns the checksum of given record.
+         * @param[in] rec record
+         */
+        static uint8_t checksum(const record_t& rec);
+        
+        /**
+         * Returns the sequence number following the given. The value 0xff is
+         * reserved for unused slots.
+         * @param[in] seq sequence number
+         */
+        static uint8_t next(uint8_t seq)
+        {
+          return (seq == 0xfe ? 0 : seq + 1);
+        }
+        
+        EEPROM    m_eeprom;     //<! EEPROM device.
+        record_t* m_start;      //<! EEPROM address of first slot.
+        uint8_t   m_records;    //<! Number of slots.
+        uint8_t   m_head;       //<! Slot for next record.
+        uint8_t   m_count;      //<! Number of records in journal.
+        uint8_t   m_seq;        //<! Sequence number of next record.
     };
     
     /**
@@ -229,13 +575,15 @@ class ELFI
          * @param[in] parent object
          */
         WebServer(ELFI * parent) :
-          m_parent(parent)
+          m_parent(parent),
+          m_routes_count(0)
         {};
     
         /**
-         * Override of the HTTP::Server:on_request() member function. Displays
-         * the ElFi web application controll and communicats with the rest of the
-         * controll system.
+         * Override of the HTTP::Server:on_request() member function. Routes
+         * the request to the first handler matching method and path, see
+         * ELFI::register_handler(). Replies 404 (Not Found) if no handler
+         * matches.
          * @param[in] page iostream for response.
          * @param[in] method http request method string.
          * @param[in] path resource path string.
@@ -243,13 +591,55 @@ class ELFI
          */
         virtual void on_request(IOStream& page, char* method, char* path, char* query);
         
+        /**
+         * Displays the ElFi web application controll.
+         * @param[in] page iostream for response.
+         */
+        void render(IOStream& page);
+        
         /**
          * Handel queries. Parse the query char and reacts.
          * @param[in] query possible query string.
          */
         void handle_query(char* query);
         
-        ELFI * m_parent;  //<! Parnet object.
+        /** Request route; method and path are in program memory. */
+        struct route_t {
+          str_P method;     //<! Request method or NULL for any.
+          str_P path;       //<! Path prefix.
+          Handler handler;  //<! Request handler.
+        };
+        
+        /**
+         * Returns true if the route matches given method and path otherwise
+         * false.
+         * @param[in] route to match
+         * @param[in] method http request method string.
+         * @param[in] path resource path string.
+         */
+        static bool match(const route_t& route, const char* method, const char* path);
+        
+        /**
+         * Built-in handler for the ElFi web application. Renders the page or,
+         * given a query, handles the query and replies 204 (No Content).
+         */
+        static void on_page(ELFI* elfi, IOStream& page, char* method, char* path, char* query);
+        
+        /**
+         * Built-in handler for the event log. Streams the log, oldest entry
+         * first, as text or, given the query "csv", as CSV. Replies 404 (Not
+         * Found) for sub-paths.
+         */
+        static void on_log(ELFI* elfi, IOStream& page, char* method, char* path, char* query);
+        
+        /** Built-in handler for browser icon requests. */
+        static void on_icon(ELFI* elfi, IOStream& page, char* method, char* path, char* query);
+        
+        static const route_t s_routes[];                  //<! Built-in routes; ends with NULL path.
+        
+        ELFI *    m_parent;                               //<! Parnet object.
+        route_t   m_routes[WEBSERVER_HANDLERS];           //<! Registered routes.
+        uint8_t   m_routes_count;                         //<! Number of registered routes.
     };
     
     /**
@@ -260,9 +650,130 @@ class ELFI
     
     /**
      * Update the Real Time Clock on the Arduino. Also updates the time in all the
-     * alarms and activities.
+     * alarms and activities. Returns true if the time was retrieved otherwise
+     * false; the clock is left unchanged on failure.
+     * @return bool
+     */
+    bool update_RTC();
+    
+    /**
+     * Dispatch pending events, i.e. the watchdog timeouts that run the due
+     * activities. Called by run() and at safe points while serving a
+     * request.
+     */
+    void dispatch();
+    
+    /**
+     * Returns true if an enabled activity is due within given number of
+     * seconds on one of its days, or has just passed, otherwise false.
+     * @param[in] guard seconds
+     */
+    bool is_due(uint16_t guard);
+    
+    /**
+     * Admission control of HTTP requests. Returns true if the request may be
+     * served; false if SCHEDULER_HTTP_LOAD requests already have been served
+     * within the current second.
+     */
+    bool admit();
+    
+    /**
+     * Set the RTC and alarm clock. The event log is kept in line with the
+     * new time.
+     * @param[in] clock time to set
+     */
+    void set_clock(clock_t clock);
+    
+    /**
+     * Append an entry to the event log, overwriting the oldest entry if full.
+     * The entry is also kept in EEPROM if LOG_EEPROM_ENTRIES is set.
+     * @param[in] source of entry; LOG_SKETCH, LOG_BOOT, etc
+     * @param[in] device NEXA switch id, NEXA_SWITCHES for all,
+     * LOG_ACTIVITY_DEVICE plus NEXA activity id or LOG_NO_DEVICE
+     * @param[in] mode switched to, true if an activity was enabled or, for
+     * clock updates, true if successful; zero for a dropped web command
+     */
+    void log(uint8_t source, uint8_t device, int8_t mode);
+    
+    /**
+     * Load the event log entries kept in EEPROM. Called on start.
+     */
+    void load_log();
+    
+    /**
+     * Send the next RF frame of the ongoing fades if the current fade slot
+     * is free. Completed fades are recorded in the journal and freed.
+     */
+    void run_fades();
+    
+    /**
+     * Start, or keep running, a fade of given NEXA switches; see fade(). A
+     * fade from a mode to the same mode with zero duration switches them in
+     * the following fade slots. Returns true if started otherwise false; no
+     * free fade.
+     * @param[in] switches NEXA switches (bit per id)
+     * @param[in] from mode: 0 for OFF, 1 for ON and (-15 ...-1) for dim level
+     * @param[in] to mode: 0 for OFF, 1 for ON and (-15 ...-1) for dim level
+     * @param[in] seconds duration of the fade
+     */
+    bool start_fade(uint16_t switches, int8_t from, int8_t to, uint16_t seconds);
+    
+    /**
+     * Stop any fade of given NEXA switch.
+     * @param[in] id for the NEXA switch
+     */
+    void stop_fade(uint8_t id);
+    
+    /**
+     * Run the next network boot stage. A failed stage is retried after a
+     * delay that grows with each failure.
+     */
+    void boot();
+    
+    /**
+     * Restore NEXA switch states, activity configuration and the last known
+     * time from the journal. The NEXA switches with a known state are
+     * switched to that state and then reconciled, see reconcile().
+     */
+    void restore();
+    
+    /**
+     * Reconcile the NEXA switch states with the activities that should have
+     * been dispatched since the last recorded change of each switch, e.g.
+     * while ElFi was not running. Switches are only switched if the mode
+     * changes. Requires the time to be set from NTP. Switches last changed
+     * while the time was estimated from the journal, or not yet known, are
+     * not reconciled.
+     */
+    void reconcile();
+    
+    /**
+     * Set the known mode of a NEXA switch and record it in the journal if
+     * changed.
+     * @param[in] id for the NEXA switch; NEXA_SWITCHES for all switches
+     * @param[in] mode switched to
+     */
+    void set_mode(uint8_t id, int8_t mode);
+    
+    /**
+     * Append a record to the journal. Compacts the journal when full.
+     * @param[in] type of record
+     * @param[in] id number for NEXA switch or activity
+     * @param[in] value of record
+     */
+    void record(uint8_t type, uint8_t id, int8_t value);
+    
+    /**
+     * Compact the journal by appending a snapshot of all NEXA switch states
+     * and activity configuration.
+     */
+    void compact();
+    
+    /**
+     * Compute today's sunrise and sunset and move the activities triggered
+     * by the sun to their time of dispatch today. Called once a day.
      */
-    void update_RTC();
+    void update_sun();
     
     /**
      * Get the current time from a NTP. Returns the clock is successful
@@ -282,12 +793,91 @@ class ELFI
     bool                m_webserverflag;
     WebServer           m_webserver;
     Alarm::Scheduler    m_scheduler;
+    bool                m_time_valid;                         //<! RTC has been set.
+    bool                m_time_estimated;                     //<! RTC was set from the journal; not yet from NTP.
+    
+    // Scheduler
+    uint16_t            m_lateness;                           //<! Lateness of latest activity dispatch (s).
+    uint16_t            m_lateness_max;                       //<! Max lateness of activity dispatch (s).
+    uint32_t            m_http_second;                        //<! Current second of HTTP admission.
+    uint8_t             m_http_count;                         //<! HTTP requests admitted within second.
+    
+    // Boot
+    uint8_t             m_boot_stage;                         //<! Current boot stage.
+    uint32_t            m_boot_start;                         //<! Start of current boot stage (ms).
+    uint32_t            m_boot_attempt;                       //<! Time of latest failed attempt (ms).
+    uint32_t            m_boot_retry;                         //<! Delay before next retry (ms); zero if none.
+    uint32_t            m_boot_time[BOOT_STAGES];             //<! Time to complete boot stages (ms).
+    
+    // Journal
+    static const int8_t UNKNOWN_MODE = 127;                   //<! NEXA switch mode is unknown.
+    static const uint8_t SNAPSHOT_MAX = 2 + NEXA_SWITCHES + NEXA_ACTIVITIES; //<! Max records in a snapshot.
+    Journal             m_journal;                            //<! Journal of states and configuration.
+    uint8_t             m_journal_since;                      //<! Records since latest snapshot.
+    clock_t             m_journal_clock;                      //<! Latest recorded time.
+    
+    // Event log
+    static const uint8_t LOG_NO_DEVICE = 0x1f;                //<! Entry not related to a NEXA switch or activity.
+    static const uint8_t LOG_ACTIVITY_DEVICE = NEXA_SWITCHES + 1; //<! Device of NEXA activity 0.
+    
+    /** Event log entry. */
+    struct log_entry_t {
+      uint16_t delta;                                         //<! Seconds since previous entry; minutes if bit 15 set.
+      uint8_t source_device;                                  //<! Source (bit 5-7) and device (bit 0-4).
+      int8_t mode;                                            //<! Mode switched to.
+    };
+    
+    log_entry_t         m_log[LOG_ENTRIES];                   //<! Event log ring buffer.
+    uint8_t             m_log_head;                           //<! Index of next entry.
+    uint8_t             m_log_count;                          //<! Number of entries.
+    uint8_t             m_log_source;                         //<! Source of switch commands.
+    uint8_t             m_log_loaded;                         //<! Number of oldest entries loaded from EEPROM.
+    clock_t             m_log_clock;                          //<! Time of newest entry.
+    clock_t             m_log_loaded_clock;                   //<! Time of newest entry loaded from EEPROM.
+    int8_t              m_log_ntp;                            //<! Latest logged NTP outcome; -1 if none.
+#if LOG_EEPROM_ENTRIES > 0
+    Journal             m_log_spill;                          //<! Latest entries in EEPROM.
+#endif
+
+    // The journal and event log must fit in EEPROM; the record size is not
+    // known to the preprocessor
+#if defined(E2END)
+    static_assert(JOURNAL_EEPROM_START + JOURNAL_RECORDS * sizeof(Journal::record_t) <= E2END + 1L,
+                  "JOURNAL_RECORDS exceed the EEPROM");
+#if LOG_EEPROM_ENTRIES > 0
+    static_assert(LOG_EEPROM_START + LOG_EEPROM_ENTRIES * sizeof(Journal::record_t) <= E2END + 1L,
+                  "LOG_EEPROM_ENTRIES exceed the EEPROM");
+#endif
+#endif
+    
+    // Fades
+    static const uint8_t FADE_LEVEL_NONE = 0xff;              //<! No fade level sent.
+    
+    /** Fade of one or more switches. Levels are 0 (off), 1..15 (dim) and 16 (on). */
+    struct fade_t {
+      uint16_t switches;                                      //<! NEXA switches fading (bit per id); zero if free.
+      uint8_t from;                                           //<! Level to fade from.
+      uint8_t to;                                             //<! Level to fade to.
+      uint32_t start;                                         //<! Start time (ms).
+      uint32_t duration;                                      //<! Duration (ms).
+    };
+    
+    fade_t              m_fades[FADES];                       //<! Ongoing fades.
+    uint8_t             m_fade_level[NEXA_SWITCHES];          //<! Level last sent by a fade.
+    uint8_t             m_fade_next;                          //<! Next NEXA switch to send a fade frame to.
+    uint32_t            m_fade_slot;                          //<! Start of current fade slot (ms).
+    
+    // Sun
+    uint16_t            m_sunrise;                            //<! Today's sunrise; minutes after midnight.
+    uint16_t            m_sunset;                             //<! Today's sunset; minutes after midnight.
+    clock_t             m_sun_next;                           //<! Time of next update of sun times.
 
     // NEXA switches
     uint8_t             m_switch_id[NEXA_SWITCHES];           //<! NEXA switch id number.
     String              m_switch_name[NEXA_SWITCHES];         //<! NEXA switch name.
     bool                m_switch_dimable[NEXA_SWITCHES];      //<! NEXA switch is dimable or not
     bool                m_switch_activated[NEXA_SWITCHES];    //<! NEXA switch is used or not, i.e. if it has been activated or not
+    int8_t              m_switch_mode[NEXA_SWITCHES];         //<! NEXA switch last commanded mode or UNKNOWN_MODE
     
     // NEXA activities
     NEXAActivity        m_activities[NEXA_ACTIVITIES];        //<! NEXA activities.
@@ -39,6 +39,18 @@
  *                      the number wisely. Default is 5.
  * - NTP_TIME_ZONE      Offset from GMT. Default is 1.
  * - NTP_SERVER         NTP server to use. Default is "se.pool.ntp.org"
+ * - SUN_LATITUDE       Latitude and longitude in hundredths of a degree
+ *   SUN_LONGITUDE      used for activities triggered by sunrise or
+ *                      sunset. Default is Stockholm (5933, 1807).
+ * - LOG_ENTRIES        The number of entries in the event log shown at
+ *                      http://10.0.1.190/log (or /log?csv). Default is 32.
+ * - LOG_EEPROM_ENTRIES The number of latest event log entries kept in
+ *                      EEPROM over a restart. Default is 0 (disabled).
+ * - FADES              The number of concurrent fades of dimable
+ *                      switches. Default is 4.
+ * - JOURNAL_RECORDS    The number of records in the EEPROM journal of
+ *                      switch states, used to restore the switches after
+ *                      a power cut. Default is 56 (504 bytes EEPROM).
  *
  * In order for ElFi to work, you need:
  * - Arduino with Ethernet Sheild (or WiFi sheild)
@@ -99,13 +111,34 @@ NEXA::Transmitter transmitter(Board::D9, 0xc05a01L);
 // The one and only ElFi object
 ELFI elfi;
 
+// Path of the time request handler in program memory
+const char TIME_PATH[] __PROGMEM = "/time";
+
+// Request handler for http://10.0.1.190/time; replies the current time. The
+// route matches sub-paths as well; these are not found
+void on_time(ELFI* elfi, IOStream& page, char* method, char* path, char* query)
+{
+  UNUSED(elfi);
+  UNUSED(method);
+  UNUSED(query);
+  if (strcmp_P(path, TIME_PATH) != 0) {
+    ELFI::reply(page, 404);
+    return;
+  }
+  time_t now = RTC::time();
+  page << PSTR("HTTP/1.1 200 OK" CRLF
+               "Content-Type: text/plain" CRLF
+               "Connection: close" CRLF CRLF)
+       << now << endl;
+}
+
 void setup() {
   Watchdog::begin(16, Watchdog::push_timeout_events);
   RTC::begin();
   
   // Activate the switches
   elfi.activate_NEXA_Switch(0, "Vardagsrumsfönstret");
-  elfi.activate_NEXA_Switch(1, "Vardagsrummet");
+  elfi.activate_NEXA_Switch(1, "Vardagsrummet", true);
   elfi.activate_NEXA_Switch(2, "Hallen");
   
   // Activate the activities
@@ -113,8 +146,17 @@ void setup() {
   elfi.activate_NEXA_Activity(1, "Dagsa att gå till jobbet", WEEKDAYS, 7, 25, 0);
   elfi.activate_NEXA_Activity(2, "Dags att sova", BEFOREWORKDAY, 22, 40, 0);
   elfi.activate_NEXA_Activity(3, "God morgon", WEEKENDDAYS, 8, 30, 1);
+  elfi.activate_NEXA_Activity(4, "Skymning", ALLDAYS, ELFI::SUNSET, -30, 1, 0);
+  
+  // Wake up slowly; fade the dimable switches from off to on in 20 minutes.
+  // Switches that are not dimable are switched on one at a time
+  elfi.fade_NEXA_Activity(0, 0, 1200);
+  
+  // Add request handlers to the web server
+  elfi.register_handler(PSTR("GET"), (str_P) TIME_PATH, on_time);
   
-  // Start ElFi with a transmitter, ethernet connection and use HTTP access
+  // Start ElFi with a transmitter, ethernet connection and use HTTP access.
+  // The network is brought up in the background by elfi.run().
   elfi.begin(&transmitter, &ethernet, true);
 }
 